@@ -0,0 +1,142 @@
+#ifndef DrawList_h
+#define DrawList_h
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include <X11/Xlib.h>
+
+struct DrawBatch {
+    unsigned long int color;
+    unsigned int width;
+    std::vector<XSegment> segments;
+};
+
+/*
+ * A frame, or a chunk of a streamed frame, of line segments grouped into
+ * batches by slot. A slot is one line style: FTree uses one per level, a
+ * Forest one per palette level so the same style from many trees merges.
+ * Each batch is sent to the server with a single XDrawSegments call. Cleared
+ * lists keep their storage so a recycled frame does not reallocate.
+ */
+class DrawList {
+    /* Variables */
+    public:
+    double pauseTime = 0.0;
+    bool frameEnd = false;
+    // Layer lists are drawn once into the persistent layer pixmap that
+    // every frame starts from; clearLayer blanks it first
+    bool layer = false;
+    bool clearLayer = false;
+    // The rest of a dropped frame is discarded instead of presented
+    bool dropped = false;
+
+    private:
+    std::vector<DrawBatch> batches;
+    unsigned int numBatches = 0;
+    std::size_t numSegments = 0;
+
+    /* Functions */
+    public:
+    void Clear() {
+        for (unsigned int i = 0; i < numBatches; i++) {
+            batches[i].segments.clear();
+        }
+        numBatches = 0;
+        numSegments = 0;
+        pauseTime = 0.0;
+        frameEnd = false;
+        layer = false;
+        clearLayer = false;
+        dropped = false;
+    }
+
+    std::size_t Size() const {
+        return numSegments;
+    }
+
+    void Add(unsigned int slot, unsigned long int color, unsigned int width,
+             double x1, double y1, double x2, double y2) {
+        if (slot >= numBatches) {
+            if (slot >= batches.size()) {
+                batches.resize(slot + 1);
+            }
+            numBatches = slot + 1;
+        }
+        DrawBatch& batch = batches[slot];
+        batch.color = color;
+        batch.width = width;
+        if (!ClipToShort(x1, y1, x2, y2)) {
+            return;
+        }
+        XSegment segment;
+        segment.x1 = static_cast<short>(x1);
+        segment.y1 = static_cast<short>(y1);
+        segment.x2 = static_cast<short>(x2);
+        segment.y2 = static_cast<short>(y2);
+        batch.segments.push_back(segment);
+        numSegments++;
+    }
+
+    // XSegment holds shorts, so clip the segment to that range (Liang-Barsky)
+    // instead of letting the casts overflow. False if nothing is left or an
+    // end point is not finite.
+    static bool ClipToShort(double& x1, double& y1, double& x2, double& y2) {
+        if (!std::isfinite(x1) || !std::isfinite(y1) ||
+            !std::isfinite(x2) || !std::isfinite(y2)) {
+            return false;
+        }
+        const double limit = 32000.0;
+        double dx = x2 - x1;
+        double dy = y2 - y1;
+        double p[4] = {-dx, dx, -dy, dy};
+        double q[4] = {x1 + limit, limit - x1, y1 + limit, limit - y1};
+        double t0 = 0.0;
+        double t1 = 1.0;
+        for (int i = 0; i < 4; i++) {
+            if (p[i] == 0.0) {
+                if (q[i] < 0.0) {
+                    return false;
+                }
+                continue;
+            }
+            double t = q[i] / p[i];
+            if (p[i] < 0.0) {
+                t0 = std::max(t0, t);
+            } else {
+                t1 = std::min(t1, t);
+            }
+        }
+        if (t0 > t1) {
+            return false;
+        }
+        double startX = x1;
+        double startY = y1;
+        x1 = startX + t0 * dx;
+        y1 = startY + t0 * dy;
+        x2 = startX + t1 * dx;
+        y2 = startY + t1 * dy;
+        return true;
+    }
+
+    void Submit(Display* pDisplay, Drawable drawable, GC gc) const {
+        for (unsigned int i = 0; i < numBatches; i++) {
+            const DrawBatch& batch = batches[i];
+            if (batch.segments.empty()) {
+                continue;
+            }
+            XSetLineAttributes(pDisplay, gc, batch.width, LineSolid, CapRound, JoinRound);
+            XSetForeground(pDisplay, gc, batch.color);
+            XDrawSegments(
+                pDisplay,
+                drawable,
+                gc,
+                const_cast<XSegment*>(batch.segments.data()),
+                batch.segments.size()
+            );
+        }
+    }
+};
+
+#endif
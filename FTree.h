@@ -2,9 +2,14 @@
 #define FTree_h
 
 #include <cmath>
+#include <cstddef>
+#include <functional>
+#include <vector>
 #define PI 3.14159265359
 #include <X11/Xlib.h>
 
+#include "DrawList.h"
+
 struct Point {
     double x;
     double y;
@@ -42,7 +47,7 @@ struct Branch {
     Point end;
     unsigned long int color;
     unsigned int width;
-    Branch** pBranches;
+    Branch** pBranches = nullptr;
 };
 
 struct Color {
@@ -65,6 +70,37 @@ struct Color {
     unsigned long int GetLong() {
         return (red << 16) + (green << 8) + blue;
     }
+
+    static Color Blend(const Color& from, const Color& to, double perc) {
+        Color color;
+        color.red = static_cast<double>(to.red - from.red) * perc;
+        color.red += from.red;
+        color.green = static_cast<double>(to.green - from.green) * perc;
+        color.green += from.green;
+        color.blue = static_cast<double>(to.blue - from.blue) * perc;
+        color.blue += from.blue;
+        return color;
+    }
+};
+
+/*
+ * Per-level template shared by every branch at the same depth. Depth 0 is
+ * the trunk; a branch at depth d is its parent vector scaled by scale and
+ * rotated by +/- the level angle.
+ */
+struct Level {
+    double cosAngle;
+    double sinAngle;
+    double scale;
+    double length;
+    unsigned long int color;
+    unsigned int width;
+};
+
+struct StreamNode {
+    Point start;
+    Point end;
+    unsigned int depth;
 };
 
 class FTree {
@@ -83,9 +119,11 @@ class FTree {
     int startThickness = 10;
     bool animationFinished = false;
     unsigned int animationLevel = 0;
-    bool branchFinished = false;
     double stepDist = 0;
     double stepTotalDist = 0;
+    bool streaming = false;
+    std::vector<Level> levels;
+    std::vector<StreamNode> stack;
 
     /* Functions */
     public:
@@ -102,18 +140,11 @@ class FTree {
     }
 
     Color MapColor(unsigned int levels) {
-        Color color;
         if (numLevels == 0) {
             return endColor;
         }
         double perc = static_cast<double>(levels) / static_cast<double>(numLevels);
-        color.red = static_cast<double>(endColor.red - startColor.red) * perc;
-        color.red += startColor.red;
-        color.green = static_cast<double>(endColor.green - startColor.green) * perc;
-        color.green += startColor.green;
-        color.blue = static_cast<double>(endColor.blue - startColor.blue) * perc;
-        color.blue += startColor.blue;
-        return color;
+        return Color::Blend(startColor, endColor, perc);
     }
 
     void SetStartColor(Color start) {
@@ -124,11 +155,45 @@ class FTree {
         endColor = end;
     }
 
+    // Streaming trees never store branches, they are derived from the level
+    // table while walking so memory is O(depth) instead of O(2^depth)
+    void SetStreaming(bool streaming) {
+        this->streaming = streaming;
+    }
+
     void Grow(unsigned int numLevels, double startAngle, double startScale) {
         this->numLevels = numLevels;
-        pTrunk->color = MapColor(numLevels).GetLong();
-        pTrunk->width = startThickness;
-        BranchRec(pTrunk, numLevels, startAngle, startScale); 
+        BuildLevels(startAngle, startScale);
+        pTrunk->color = levels[0].color;
+        pTrunk->width = levels[0].width;
+        if (!streaming) {
+            BranchRec(pTrunk, 0); 
+        }
+    }
+
+    void BuildLevels(double angle, double scale) {
+        levels.resize(numLevels + 1);
+        stack.reserve(numLevels + 2);
+        Point vec = pTrunk->end - pTrunk->start;
+        double length = sqrt(pow(vec.x, 2.0) + pow(vec.y, 2.0));
+        levels[0].cosAngle = 1.0;
+        levels[0].sinAngle = 0.0;
+        levels[0].scale = 1.0;
+        levels[0].length = length;
+        levels[0].color = MapColor(numLevels).GetLong();
+        levels[0].width = startThickness;
+        for (unsigned int depth = 1; depth <= numLevels; depth++) {
+            length *= fabs(scale);
+            int thickness = startThickness - static_cast<int>(depth);
+            levels[depth].cosAngle = cos(angle);
+            levels[depth].sinAngle = sin(angle);
+            levels[depth].scale = scale;
+            levels[depth].length = length;
+            levels[depth].color = MapColor(numLevels - depth + 1).GetLong();
+            levels[depth].width = thickness > 1 ? thickness : 1;
+            angle += deltaAngle;
+            scale += deltaScale;
+        }
     }
 
     void StartAnimation(double stepDist) {
@@ -139,144 +204,168 @@ class FTree {
     }
 
     void DrawAnimationStep(Display* pDisplay, Window* pWindow, GC* pGC) {
+        DrawList drawList;
+        BuildAnimationStep(drawList);
+        drawList.Submit(pDisplay, *pWindow, *pGC);
+    }
+
+    void BuildAnimationStep(DrawList& drawList) {
+        DrawList* pDrawList = &drawList;
+        BuildAnimationStep(pDrawList, 0, nullptr);
+    }
+
+    // Emits the next animation frame into pDrawList. When batchSize is non
+    // zero, flush is called every time the list holds batchSize segments and
+    // must leave pDrawList pointing at an empty list to continue with.
+    void BuildAnimationStep(DrawList*& pDrawList, std::size_t batchSize,
+                            const std::function<void(DrawList*&)>& flush) {
         stepTotalDist += stepDist;
-        AnimateLevel(pTrunk, animationLevel, pDisplay, pWindow, pGC);
-        if (branchFinished) {
+        unsigned int depth = animationLevel;
+        bool levelFinished = stepTotalDist > levels[depth].length;
+        double perc = 1.0;
+        if (!levelFinished) {
+            perc = stepTotalDist / levels[depth].length;
+        }
+        Walk(depth, [&](unsigned int level, const Point& start, const Point& end) {
+            Point stop = end;
+            if (level == depth) {
+                stop = start + (end - start) * perc;
+            }
+            pDrawList->Add(
+                level,
+                levels[level].color,
+                levels[level].width,
+                start.x,
+                start.y,
+                stop.x,
+                stop.y
+            );
+            if (batchSize != 0 && pDrawList->Size() >= batchSize) {
+                flush(pDrawList);
+            }
+        });
+        if (levelFinished) {
             stepTotalDist = 0;
-            animationLevel++;
-            branchFinished = false;
-        } 
-        DrawLevels(pTrunk, animationLevel, pDisplay, pWindow, pGC);
+            if (animationLevel == numLevels) {
+                animationFinished = true;
+            } else {
+                animationLevel++;
+            }
+        }
     }
 
     bool AnimationFinished() {
         return animationFinished;
     }
 
-    void AnimateLevel(Branch* pBranch, unsigned int level, Display* pDisplay,
-                      Window* pWindow, GC* pGC) {
-        if (level == 0) {
-            Point vec = pBranch->end - pBranch->start;
-            double dist = sqrt(pow(vec.x, 2.0) + pow(vec.y, 2.0));
-            double desiredDist = stepTotalDist;
-            if (stepTotalDist > dist) {
-                branchFinished = true;
-                desiredDist = dist;
-                if (animationLevel == numLevels) {
-                    animationFinished = true;
-                }
-            }
-            vec = vec * (desiredDist / dist);
-            
-            XSetLineAttributes(pDisplay, *pGC, pBranch->width, LineSolid, CapRound, JoinRound);
-            XSetForeground(pDisplay, *pGC, pBranch->color); 
-            XDrawLine(
-                pDisplay, 
-                *pWindow, 
-                *pGC, 
-                pBranch->start.x, 
-                pBranch->start.y, 
-                pBranch->start.x + vec.x, 
-                pBranch->start.y + vec.y
-            );    
+    const std::vector<Level>& Levels() const {
+        return levels;
+    }
+
+    // Index of the first branch at depth when branches are stored flat,
+    // level by level, trunk first
+    static std::size_t LevelOffset(unsigned int depth) {
+        return (static_cast<std::size_t>(1) << depth) - 1;
+    }
+
+    // Visits every branch down to maxDepth, parents before children
+    template <typename Visit>
+    void Walk(unsigned int maxDepth, Visit visit) {
+        if (streaming) {
+            StreamWalk(maxDepth, visit);
         } else {
-            level--;
-            if (pBranch->pBranches != nullptr) {
-                if (pBranch->pBranches[0] != nullptr) {
-                    AnimateLevel(pBranch->pBranches[0], level, pDisplay, pWindow, pGC);
-                }
-                if (pBranch->pBranches[1] != nullptr) {
-                    AnimateLevel(pBranch->pBranches[1], level, pDisplay, pWindow, pGC);
-                }
-            }
+            WalkRec(pTrunk, 0, maxDepth, visit);
         }
     }
 
-    void DrawLevels(Branch* pBranch, unsigned int levels, Display* pDisplay, 
-                    Window* pWindow, GC* pGC) {
-        if (levels == 0) {
-           return; 
+    template <typename Visit>
+    void WalkRec(Branch* pBranch, unsigned int depth, unsigned int maxDepth, 
+                 Visit& visit) {
+        visit(depth, pBranch->start, pBranch->end);
+        if (depth == maxDepth || pBranch->pBranches == nullptr) {
+            return;
         }
-        XSetLineAttributes(pDisplay, *pGC, pBranch->width, LineSolid, CapRound, JoinRound);
-        XSetForeground(pDisplay, *pGC, pBranch->color);
-        XDrawLine(
-            pDisplay, 
-            *pWindow, 
-            *pGC, 
-            pBranch->start.x, 
-            pBranch->start.y, 
-            pBranch->end.x, 
-            pBranch->end.y
-        ); 
-        levels--;
-        if (pBranch->pBranches != nullptr) {
-            if (pBranch->pBranches[0] != nullptr) {
-                DrawLevels(pBranch->pBranches[0], levels, pDisplay, pWindow, pGC);
-            }
-            if (pBranch->pBranches[1] != nullptr) {
-                DrawLevels(pBranch->pBranches[1], levels, pDisplay, pWindow, pGC);
-            }
+        depth++;
+        if (pBranch->pBranches[0] != nullptr) {
+            WalkRec(pBranch->pBranches[0], depth, maxDepth, visit);
         }
+        if (pBranch->pBranches[1] != nullptr) {
+            WalkRec(pBranch->pBranches[1], depth, maxDepth, visit);
+        }
+    }
 
-        
+    // Depth first walk with an explicit stack of at most maxDepth + 1 nodes
+    template <typename Visit>
+    void StreamWalk(unsigned int maxDepth, Visit& visit) {
+        if (maxDepth > numLevels) {
+            maxDepth = numLevels;
+        }
+        stack.clear();
+        stack.push_back({pTrunk->start, pTrunk->end, 0});
+        while (!stack.empty()) {
+            StreamNode node = stack.back();
+            stack.pop_back();
+            visit(node.depth, node.start, node.end);
+            if (node.depth == maxDepth) {
+                continue;
+            }
+            const Level& level = levels[node.depth + 1];
+            Point vec = (node.end - node.start) * level.scale;
+            Point vecLeft;
+            vecLeft.x = vec.x * level.cosAngle - vec.y * level.sinAngle;
+            vecLeft.y = vec.x * level.sinAngle + vec.y * level.cosAngle;
+            Point vecRight;
+            vecRight.x = vec.x * level.cosAngle + vec.y * level.sinAngle;
+            vecRight.y = -vec.x * level.sinAngle + vec.y * level.cosAngle;
+            stack.push_back({node.end, node.end + vecRight, node.depth + 1});
+            stack.push_back({node.end, node.end + vecLeft, node.depth + 1});
+        }
     }
 
-    void BranchRec(Branch* pBranch, unsigned int levels, double angle, double scale) {
-        if (levels == 0) {
+    void BranchRec(Branch* pBranch, unsigned int depth) {
+        if (depth == numLevels) {
             return;
         }
+        const Level& level = levels[depth + 1];
         Branch* pLeft = new Branch;
         Branch* pRight = new Branch;
         pBranch->pBranches = new Branch*[numBranches]; 
         
         pLeft->start = pBranch->end;
         pRight->start = pBranch->end;
-        Point vec = (pBranch->end - pBranch->start) * scale;
+        Point vec = (pBranch->end - pBranch->start) * level.scale;
         Point vecLeft;
-        vecLeft.x = vec.x * cos(angle) - vec.y * sin(angle);
-        vecLeft.y = vec.x * sin(angle) + vec.y * cos(angle);
+        vecLeft.x = vec.x * level.cosAngle - vec.y * level.sinAngle;
+        vecLeft.y = vec.x * level.sinAngle + vec.y * level.cosAngle;
         Point vecRight;
-        vecRight.x = vec.x * cos(-angle) - vec.y * sin(-angle);
-        vecRight.y = vec.x * sin(-angle) + vec.y * cos(-angle);
+        vecRight.x = vec.x * level.cosAngle + vec.y * level.sinAngle;
+        vecRight.y = -vec.x * level.sinAngle + vec.y * level.cosAngle;
         pLeft->end = pBranch->end + vecLeft;
         pRight->end = pBranch->end + vecRight;
-        Color color = MapColor(levels); 
-        pLeft->color = pRight->color = color.GetLong();
-        pLeft->width = pRight->width = startThickness - (numLevels - levels) - 1;
+        pLeft->color = pRight->color = level.color;
+        pLeft->width = pRight->width = level.width;
         pBranch->pBranches[0] = pLeft;
         pBranch->pBranches[1] = pRight;
  
-        levels--;
-        angle += deltaAngle;
-        scale += deltaScale;
-        BranchRec(pLeft, levels, angle, scale);
-        BranchRec(pRight, levels, angle, scale);
+        depth++;
+        BranchRec(pLeft, depth);
+        BranchRec(pRight, depth);
     }
 
     void Draw(Display* pDisplay, Window* pWindow, GC* pGC) {
-       DrawRec(pTrunk, pDisplay, pWindow, pGC);    
-    }
-
-    void DrawRec(Branch* pBranch, Display* pDisplay, Window* pWindow, GC* pGC) {
-        XSetLineAttributes(pDisplay, *pGC, pBranch->width, LineSolid, CapRound, JoinRound);
-        XSetForeground(pDisplay, *pGC, pBranch->color);
-        XDrawLine(
-            pDisplay, 
-            *pWindow, 
-            *pGC, 
-            pBranch->start.x, 
-            pBranch->start.y, 
-            pBranch->end.x, 
-            pBranch->end.y
-        );
-        if (pBranch->pBranches) {
-            if (pBranch->pBranches[0] != nullptr) {
-                DrawRec(pBranch->pBranches[0], pDisplay, pWindow, pGC);
-            }
-            if (pBranch->pBranches[1] != nullptr) {
-                DrawRec(pBranch->pBranches[1], pDisplay, pWindow, pGC);
-            }
-        }
+        DrawList drawList;
+        Walk(numLevels, [&](unsigned int level, const Point& start, const Point& end) {
+            drawList.Add(
+                level, 
+                levels[level].color, 
+                levels[level].width, 
+                start.x, 
+                start.y, 
+                end.x, 
+                end.y
+            );
+        });
+        drawList.Submit(pDisplay, *pWindow, *pGC);
     }
 
     void Delete(Branch* pBranch) {
@@ -0,0 +1,227 @@
+#ifndef Forest_h
+#define Forest_h
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "FTree.h"
+#include "DrawList.h"
+
+struct Segment {
+    Point start;
+    Point end;
+};
+
+/*
+ * Geometry of one tree shape relative to the base of its trunk. Stored
+ * shapes keep their segments flat level by level; streamed shapes keep only
+ * the level table in pTree and derive segments while walking. Every tree
+ * grown from the same parameters shares the template and only adds its own
+ * origin.
+ */
+struct TreeTemplate {
+    std::vector<Level> levels;
+    std::unique_ptr<FTree> pTree;
+    Point base;
+    std::vector<Segment> segments;
+    std::vector<std::size_t> levelOffsets;
+};
+
+struct ForestTree {
+    Point origin;
+    unsigned int shape;
+    unsigned int palette;
+    unsigned int delaySteps;
+    unsigned int animationLevel;
+    double stepTotalDist;
+    bool finished;
+};
+
+class Forest {
+    /* Variables */
+    private:
+    unsigned int numLevels;
+    bool streaming;
+    double stepDist = 0;
+    bool animationFinished = false;
+    std::vector<TreeTemplate> templates;
+    std::vector<std::vector<unsigned long int>> palettes;
+    std::vector<ForestTree> trees;
+
+    /* Functions */
+    public:
+    Forest(unsigned int numLevels, bool streaming) {
+        this->numLevels = numLevels;
+        this->streaming = streaming;
+    }
+
+    unsigned int AddShape(double deltaAngle, double deltaScale, int startHeight,
+                          double startAngle, double startScale) {
+        TreeTemplate shape;
+        shape.pTree.reset(new FTree(0, startHeight, deltaAngle, deltaScale, startHeight));
+        shape.pTree->SetStreaming(true);
+        shape.pTree->Grow(numLevels, startAngle, startScale);
+        shape.levels = shape.pTree->Levels();
+        shape.base = Point(0.0, static_cast<double>(startHeight));
+        if (!streaming) {
+            shape.levelOffsets.resize(numLevels + 2);
+            for (unsigned int depth = 0; depth <= numLevels + 1; depth++) {
+                shape.levelOffsets[depth] = FTree::LevelOffset(depth);
+            }
+            shape.segments.resize(shape.levelOffsets[numLevels + 1]);
+            std::vector<std::size_t> cursors(shape.levelOffsets.begin(),
+                                             shape.levelOffsets.end() - 1);
+            shape.pTree->Walk(numLevels, [&](unsigned int level, const Point& start, const Point& end) {
+                Segment& segment = shape.segments[cursors[level]++];
+                segment.start = start - shape.base;
+                segment.end = end - shape.base;
+            });
+        }
+        templates.push_back(std::move(shape));
+        return templates.size() - 1;
+    }
+
+    // Colors follow the same gradient FTree::BuildLevels uses for a tree
+    unsigned int AddPalette(Color start, Color end) {
+        std::vector<unsigned long int> colors(numLevels + 1);
+        for (unsigned int depth = 0; depth <= numLevels; depth++) {
+            double perc = 1.0;
+            if (numLevels != 0 && depth != 0) {
+                perc = static_cast<double>(numLevels - depth + 1) / static_cast<double>(numLevels);
+            }
+            colors[depth] = Color::Blend(start, end, perc).GetLong();
+        }
+        palettes.push_back(colors);
+        return palettes.size() - 1;
+    }
+
+    void AddTree(Point origin, unsigned int shape, unsigned int palette,
+                 unsigned int delaySteps) {
+        ForestTree tree;
+        tree.origin = origin;
+        tree.shape = shape;
+        tree.palette = palette;
+        tree.delaySteps = delaySteps;
+        tree.animationLevel = 0;
+        tree.stepTotalDist = 0;
+        tree.finished = false;
+        trees.push_back(tree);
+    }
+
+    void StartAnimation(double stepDist) {
+        this->stepDist = stepDist;
+        animationFinished = trees.empty();
+    }
+
+    bool AnimationFinished() {
+        return animationFinished;
+    }
+
+    void BuildAnimationStep(DrawList& drawList) {
+        DrawList* pDrawList = &drawList;
+        BuildAnimationStep(pDrawList, 0, nullptr);
+    }
+
+    // Same contract as FTree::BuildAnimationStep. Branch width only depends
+    // on level, so segments of every tree that share a palette and level go
+    // to the same slot and the number of draw calls depends on palettes and
+    // levels, not on the number of trees.
+    //
+    // When flush is given, a level is emitted in full exactly once, in lists
+    // flagged layer, when it finishes growing; the renderer keeps those in a
+    // persistent pixmap. Frames then only hold the levels still growing, so
+    // finished levels and finished trees cost nothing per frame. Without
+    // flush every frame repeats all finished levels.
+    void BuildAnimationStep(DrawList*& pDrawList, std::size_t batchSize,
+                            const std::function<void(DrawList*&)>& flush) {
+        bool layered = static_cast<bool>(flush);
+        auto emit = [&](ForestTree& tree, unsigned int level, double perc, bool layer) {
+            TreeTemplate& shape = templates[tree.shape];
+            unsigned int slot = tree.palette * (numLevels + 1) + level;
+            unsigned long int color = palettes[tree.palette][level];
+            unsigned int width = shape.levels[level].width;
+            WalkLevel(shape, level, [&](const Point& relStart, const Point& relEnd) {
+                Point start = tree.origin + relStart;
+                Point end = start + (relEnd - relStart) * perc;
+                pDrawList->layer = layer;
+                pDrawList->Add(slot, color, width, start.x, start.y, end.x, end.y);
+                if (batchSize != 0 && pDrawList->Size() >= batchSize) {
+                    flush(pDrawList);
+                }
+            });
+        };
+
+        // Advance every tree, sending levels that just finished to the layer
+        bool allFinished = true;
+        for (ForestTree& tree : trees) {
+            if (tree.delaySteps > 0) {
+                tree.delaySteps--;
+                allFinished = false;
+                continue;
+            }
+            if (tree.finished) {
+                continue;
+            }
+            const TreeTemplate& shape = templates[tree.shape];
+            tree.stepTotalDist += stepDist;
+            if (tree.stepTotalDist > shape.levels[tree.animationLevel].length) {
+                if (layered) {
+                    emit(tree, tree.animationLevel, 1.0, true);
+                }
+                tree.stepTotalDist = 0;
+                if (tree.animationLevel == numLevels) {
+                    tree.finished = true;
+                } else {
+                    tree.animationLevel++;
+                }
+            }
+            if (!tree.finished) {
+                allFinished = false;
+            }
+        }
+        if (pDrawList->layer) {
+            if (pDrawList->Size() > 0) {
+                flush(pDrawList);
+            }
+            pDrawList->layer = false;
+        }
+
+        // The frame itself only holds partially grown levels
+        for (ForestTree& tree : trees) {
+            if (!layered) {
+                unsigned int fullLevels = tree.finished ? numLevels + 1 : tree.animationLevel;
+                for (unsigned int level = 0; level < fullLevels; level++) {
+                    emit(tree, level, 1.0, false);
+                }
+            }
+            if (!tree.finished && tree.stepTotalDist > 0.0) {
+                const TreeTemplate& shape = templates[tree.shape];
+                double perc = tree.stepTotalDist / shape.levels[tree.animationLevel].length;
+                emit(tree, tree.animationLevel, perc, false);
+            }
+        }
+        animationFinished = allFinished;
+    }
+
+    private:
+    // Visits the segments of one level relative to the trunk base
+    template <typename Visit>
+    void WalkLevel(TreeTemplate& shape, unsigned int level, Visit visit) {
+        if (!streaming) {
+            for (std::size_t i = shape.levelOffsets[level];
+                 i < shape.levelOffsets[level + 1]; i++) {
+                visit(shape.segments[i].start, shape.segments[i].end);
+            }
+            return;
+        }
+        shape.pTree->Walk(level, [&](unsigned int depth, const Point& start, const Point& end) {
+            if (depth == level) {
+                visit(start - shape.base, end - shape.base);
+            }
+        });
+    }
+};
+
+#endif
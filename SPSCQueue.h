@@ -0,0 +1,108 @@
+#ifndef SPSCQueue_h
+#define SPSCQueue_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+/*
+ * Bounded lock-free queue for exactly one producer thread and one consumer
+ * thread. Capacity must be a power of two; head and tail are free running
+ * counters so all Capacity slots are usable.
+ *
+ * Push and Pop never block. A side that finds the queue empty or full can
+ * Wait instead of polling; the mutex is only taken while someone waits, so
+ * the data path stays lock-free.
+ */
+template <typename T, std::size_t Capacity>
+class SPSCQueue {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                  "SPSCQueue capacity must be a power of two");
+
+    /* Variables */
+    private:
+    T slots[Capacity];
+    alignas(64) std::atomic<std::size_t> head{0};
+    alignas(64) std::atomic<std::size_t> tail{0};
+    alignas(64) std::atomic<unsigned int> waiters{0};
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    /* Functions */
+    public:
+    bool Push(const T& item) {
+        std::size_t currTail = tail.load(std::memory_order_relaxed);
+        if (currTail - head.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        slots[currTail & (Capacity - 1)] = item;
+        tail.store(currTail + 1, std::memory_order_release);
+        WakeWaiter();
+        return true;
+    }
+
+    bool Pop(T& item) {
+        std::size_t currHead = head.load(std::memory_order_relaxed);
+        if (currHead == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = slots[currHead & (Capacity - 1)];
+        head.store(currHead + 1, std::memory_order_release);
+        WakeWaiter();
+        return true;
+    }
+
+    bool Empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    bool Full() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire) == Capacity;
+    }
+
+    // Blocks until ready returns true. Ready is rechecked after every Push,
+    // Pop and Notify, so it may test the queue and any state whose writer
+    // calls Notify after changing it.
+    template <typename Ready>
+    void Wait(Ready ready) {
+        std::unique_lock<std::mutex> lock(mutex);
+        BeginWait();
+        condition.wait(lock, ready);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Same as Wait but gives up after timeout
+    template <typename Ready>
+    void WaitFor(Ready ready, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        BeginWait();
+        condition.wait_for(lock, timeout, ready);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Wakes a waiter so it rechecks its condition
+    void Notify() {
+        std::lock_guard<std::mutex> lock(mutex);
+        condition.notify_all();
+    }
+
+    private:
+    // Count the waiter before ready reads the counters; pairs with the
+    // fence in WakeWaiter so either the waiter sees the new counter or
+    // the other side sees the waiter and notifies
+    void BeginWait() {
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void WakeWaiter() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) != 0) {
+            Notify();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,476 @@
+#ifndef SharedTree_h
+#define SharedTree_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "FTree.h"
+#include "DrawList.h"
+
+// Changes whenever the layout of the segment does
+const std::uint32_t sharedTreeMagic = 0x46545246;
+// Two slots of 2^(levels + 1) 16 byte segments: 64 MiB at 20 levels
+const unsigned int maxSharedLevels = 20;
+
+struct SharedLevel {
+    float length;
+    std::uint32_t width;
+    std::uint64_t color;
+};
+
+// Segments are stored relative to the base of the trunk and divided by the
+// screen height of the publisher, so every screen can scale them to its own
+struct SharedSegment {
+    float x1;
+    float y1;
+    float x2;
+    float y2;
+};
+
+struct SharedTreeSlot {
+    std::atomic<std::uint32_t> seq;
+    std::uint32_t numLevels;
+    // Screen height of the publisher, which animation speed is relative to
+    std::uint32_t height;
+    SharedLevel levels[maxSharedLevels + 1];
+    std::uint64_t levelOffsets[maxSharedLevels + 2];
+};
+
+/*
+ * Start of the shared memory segment. Two slots are followed by their
+ * segment arrays. The publisher always writes the slot readers are not
+ * pointed at, and each slot is guarded by a seqlock: seq is odd while the
+ * slot is written, so a reader that sees seq change knows its copy is torn.
+ */
+struct SharedTreeHeader {
+    std::atomic<std::uint32_t> magic;
+    std::uint32_t maxLevels;
+    std::uint64_t size;
+    std::atomic<std::uint64_t> generation;
+    std::atomic<std::uint32_t> current;
+    SharedTreeSlot slots[2];
+};
+
+class SharedTreeView;
+
+/*
+ * Shares the generated tree between the saver processes of one machine. The
+ * process holding an exclusive flock on the segment is the publisher and
+ * every other process maps it read only. When the publisher exits its lock
+ * is released and the next reader to call Connect takes over. Every
+ * process also holds a shared record lock on a second descriptor; whoever
+ * can upgrade it to exclusive on the way out is the last one and unlinks the
+ * segment. A process that crashes still drops its lock, but if it was the
+ * last one the segment stays until another saver attaches and exits.
+ */
+class SharedTree {
+    /* Variables */
+    private:
+    std::string name;
+    int fd = -1;
+    int presenceFd = -1;
+    void* pMap = nullptr;
+    std::size_t mapSize = 0;
+    bool publisher = false;
+    unsigned int layoutLevels = 0;
+    std::uint64_t seenGeneration = 0;
+
+    /* Functions */
+    public:
+    SharedTree(const std::string& name) {
+        this->name = name;
+    }
+
+    static std::size_t SlotCapacity(unsigned int maxLevels) {
+        return FTree::LevelOffset(maxLevels + 1);
+    }
+
+    static std::size_t SegmentOffset(unsigned int maxLevels, unsigned int slot) {
+        std::size_t offset = (sizeof(SharedTreeHeader) + 63) & ~static_cast<std::size_t>(63);
+        return offset + slot * SlotCapacity(maxLevels) * sizeof(SharedSegment);
+    }
+
+    bool Connect(unsigned int maxLevels) {
+        if (maxLevels > maxSharedLevels) {
+            return false;
+        }
+        if (presenceFd < 0 && !Attach()) {
+            return false;
+        }
+        if (fd < 0) {
+            fd = shm_open(name.c_str(), O_RDWR, 0600);
+            if (fd < 0) {
+                return false;
+            }
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            return BecomePublisher(maxLevels);
+        }
+        // Readers map the segment in Acquire, once the publisher sized it
+        publisher = false;
+        return true;
+    }
+
+    bool IsPublisher() {
+        return publisher;
+    }
+
+    void Publish(FTree& fTree, unsigned int width, unsigned int height) {
+        SharedTreeHeader* pHeader = static_cast<SharedTreeHeader*>(pMap);
+        const std::vector<Level>& levels = fTree.Levels();
+        unsigned int numLevels = levels.size() - 1;
+        if (numLevels > pHeader->maxLevels) {
+            return;
+        }
+        unsigned int next = 1 - pHeader->current.load(std::memory_order_relaxed);
+        SharedTreeSlot& slot = pHeader->slots[next];
+        SharedSegment* pSegments = WritableSegments(next);
+
+        slot.seq.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        double scale = 1.0 / height;
+        slot.numLevels = numLevels;
+        slot.height = height;
+        for (unsigned int depth = 0; depth <= numLevels; depth++) {
+            slot.levels[depth].length = levels[depth].length * scale;
+            slot.levels[depth].width = levels[depth].width;
+            slot.levels[depth].color = levels[depth].color;
+            slot.levelOffsets[depth] = FTree::LevelOffset(depth);
+        }
+        slot.levelOffsets[numLevels + 1] = FTree::LevelOffset(numLevels + 1);
+        std::vector<std::size_t> cursors(slot.levelOffsets, slot.levelOffsets + numLevels + 1);
+        Point base(width / 2, height);
+        fTree.Walk(numLevels, [&](unsigned int level, const Point& start, const Point& end) {
+            SharedSegment& segment = pSegments[cursors[level]++];
+            segment.x1 = (start.x - base.x) * scale;
+            segment.y1 = (start.y - base.y) * scale;
+            segment.x2 = (end.x - base.x) * scale;
+            segment.y2 = (end.y - base.y) * scale;
+        });
+        slot.seq.fetch_add(1, std::memory_order_release);
+
+        pHeader->current.store(next, std::memory_order_release);
+        pHeader->generation.fetch_add(1, std::memory_order_release);
+    }
+
+    // Waits up to timeout for a tree this reader has not shown yet
+    bool Acquire(SharedTreeView& view, std::chrono::milliseconds timeout,
+                 const std::atomic<bool>& running);
+
+    bool Valid(unsigned int slot, std::uint32_t seq) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return Header()->slots[slot].seq.load(std::memory_order_relaxed) == seq;
+    }
+
+    const SharedTreeSlot& Slot(unsigned int slot) {
+        return Header()->slots[slot];
+    }
+
+    // Uses the layout seen when the tree was acquired so a publisher that
+    // grows the segment can never push reads past the end of this mapping
+    const SharedSegment* Segments(unsigned int slot) {
+        return WritableSegments(slot);
+    }
+
+    ~SharedTree() {
+        Unmap();
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (presenceFd >= 0) {
+            if (LockPresence(presenceFd, F_WRLCK, F_OFD_SETLK)) {
+                shm_unlink(name.c_str());
+            }
+            close(presenceFd);
+        }
+    }
+
+    private:
+    SharedTreeHeader* Header() {
+        return static_cast<SharedTreeHeader*>(pMap);
+    }
+
+    SharedSegment* WritableSegments(unsigned int slot) {
+        return reinterpret_cast<SharedSegment*>(
+            static_cast<char*>(pMap) + SegmentOffset(layoutLevels, slot));
+    }
+
+    // Open file description record locks, so they belong to the descriptor
+    // like flock but do not conflict with the publisher's flock
+    static bool LockPresence(int lockFd, short type, int command) {
+        struct flock lock = {};
+        lock.l_type = type;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = 0;
+        lock.l_len = 1;
+        return fcntl(lockFd, command, &lock) == 0;
+    }
+
+    // Opens the segment and takes the shared presence lock. A process that
+    // is leaving may unlink the name between the open and the lock, so the
+    // name is reopened to check this descriptor is still the live segment.
+    bool Attach() {
+        for (int attempt = 0; attempt < 3; attempt++) {
+            int candidate = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+            if (candidate < 0) {
+                return false;
+            }
+            if (!LockPresence(candidate, F_RDLCK, F_OFD_SETLKW)) {
+                close(candidate);
+                return false;
+            }
+            int check = shm_open(name.c_str(), O_RDWR, 0600);
+            struct stat held;
+            struct stat named;
+            bool live = check >= 0 && fstat(candidate, &held) == 0 &&
+                        fstat(check, &named) == 0 && held.st_dev == named.st_dev &&
+                        held.st_ino == named.st_ino;
+            if (check >= 0) {
+                close(check);
+            }
+            if (live) {
+                presenceFd = candidate;
+                return true;
+            }
+            close(candidate);
+        }
+        return false;
+    }
+
+    void Unmap() {
+        if (pMap != nullptr) {
+            munmap(pMap, mapSize);
+            pMap = nullptr;
+            mapSize = 0;
+        }
+    }
+
+    // The segment only ever grows so readers mapped at an older size stay
+    // valid; the header keeps the layout of whoever published last
+    bool BecomePublisher(unsigned int maxLevels) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            return false;
+        }
+        std::size_t size = SegmentOffset(maxLevels, 2);
+        bool reuse = false;
+        if (static_cast<std::size_t>(st.st_size) >= sizeof(SharedTreeHeader)) {
+            Unmap();
+            pMap = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (pMap == MAP_FAILED) {
+                pMap = nullptr;
+                return false;
+            }
+            mapSize = st.st_size;
+            reuse = Header()->magic.load(std::memory_order_acquire) == sharedTreeMagic &&
+                    Header()->maxLevels >= maxLevels;
+        }
+        if (!reuse) {
+            if (static_cast<std::size_t>(st.st_size) < size && ftruncate(fd, size) != 0) {
+                return false;
+            }
+            Unmap();
+            pMap = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (pMap == MAP_FAILED) {
+                pMap = nullptr;
+                return false;
+            }
+            mapSize = size;
+            SharedTreeHeader* pHeader = Header();
+            pHeader->magic.store(0, std::memory_order_relaxed);
+            pHeader->maxLevels = maxLevels;
+            pHeader->size = size;
+            pHeader->current.store(0, std::memory_order_relaxed);
+            pHeader->slots[0].numLevels = 0;
+            pHeader->slots[1].numLevels = 0;
+            // Bump rather than reset so views attached to the old layout
+            // see their slot change
+            pHeader->slots[0].seq.fetch_add(2, std::memory_order_relaxed);
+            pHeader->slots[1].seq.fetch_add(2, std::memory_order_relaxed);
+            pHeader->magic.store(sharedTreeMagic, std::memory_order_release);
+        }
+        layoutLevels = Header()->maxLevels;
+        publisher = true;
+        return true;
+    }
+
+    bool MapReader() {
+        publisher = false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(SharedTreeHeader)) {
+            return false;
+        }
+        if (pMap != nullptr && mapSize == static_cast<std::size_t>(st.st_size)) {
+            return true;
+        }
+        Unmap();
+        pMap = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (pMap == MAP_FAILED) {
+            pMap = nullptr;
+            return false;
+        }
+        mapSize = st.st_size;
+        return true;
+    }
+};
+
+/*
+ * Animates a tree published in a SharedTree, reading segments straight from
+ * the mapping and scaling them to this screen. Same animation interface as
+ * FTree. If the publisher reuses the slot mid animation the frame is marked
+ * dropped and the animation ends so the next published tree is picked up.
+ */
+class SharedTreeView {
+    /* Variables */
+    private:
+    SharedTree* pShared = nullptr;
+    unsigned int slot = 0;
+    std::uint32_t seq = 0;
+    unsigned int numLevels = 0;
+    std::vector<Level> levels;
+    std::vector<std::size_t> levelOffsets;
+    Point base;
+    double scale = 1.0;
+    double stepScale = 1.0;
+    double stepDist = 0;
+    double stepTotalDist = 0;
+    unsigned int animationLevel = 0;
+    bool animationFinished = true;
+
+    /* Functions */
+    public:
+    SharedTreeView(unsigned int width, unsigned int height) {
+        base = Point(width / 2, height);
+        scale = height;
+    }
+
+    // Copies the level table of a slot; false if it changed while copying
+    bool Attach(SharedTree* pShared, unsigned int slot, std::uint32_t seq) {
+        this->pShared = pShared;
+        this->slot = slot;
+        this->seq = seq;
+        const SharedTreeSlot& shared = pShared->Slot(slot);
+        numLevels = shared.numLevels;
+        if (numLevels > maxSharedLevels) {
+            return false;
+        }
+        levels.resize(numLevels + 1);
+        levelOffsets.resize(numLevels + 2);
+        for (unsigned int depth = 0; depth <= numLevels; depth++) {
+            levels[depth].length = shared.levels[depth].length * scale;
+            levels[depth].width = shared.levels[depth].width;
+            levels[depth].color = shared.levels[depth].color;
+            levelOffsets[depth] = shared.levelOffsets[depth];
+        }
+        levelOffsets[numLevels + 1] = shared.levelOffsets[numLevels + 1];
+        stepScale = shared.height > 0 ? scale / shared.height : 1.0;
+        return pShared->Valid(slot, seq);
+    }
+
+    // The step is scaled by screen height like the segments, so every screen
+    // grows the tree in as many frames as the publisher and no reader falls
+    // behind far enough for its slot to be reused under it
+    void StartAnimation(double stepDist) {
+        this->stepDist = stepDist * stepScale;
+        stepTotalDist = 0;
+        animationLevel = 0;
+        animationFinished = false;
+    }
+
+    bool AnimationFinished() {
+        return animationFinished;
+    }
+
+    void BuildAnimationStep(DrawList*& pDrawList, std::size_t batchSize,
+                            const std::function<void(DrawList*&)>& flush) {
+        stepTotalDist += stepDist;
+        unsigned int depth = animationLevel;
+        bool levelFinished = stepTotalDist > levels[depth].length;
+        double perc = 1.0;
+        if (!levelFinished) {
+            perc = stepTotalDist / levels[depth].length;
+        }
+        const SharedSegment* pSegments = pShared->Segments(slot);
+        bool torn = false;
+        for (unsigned int level = 0; level <= depth && !torn; level++) {
+            for (std::size_t i = levelOffsets[level]; i < levelOffsets[level + 1]; i++) {
+                const SharedSegment& segment = pSegments[i];
+                Point start = base + Point(segment.x1 * scale, segment.y1 * scale);
+                Point end = base + Point(segment.x2 * scale, segment.y2 * scale);
+                if (level == depth) {
+                    end = start + (end - start) * perc;
+                }
+                pDrawList->Add(
+                    level,
+                    levels[level].color,
+                    levels[level].width,
+                    start.x,
+                    start.y,
+                    end.x,
+                    end.y
+                );
+                if (batchSize != 0 && pDrawList->Size() >= batchSize) {
+                    // A chunk is drawn as soon as it is flushed, so it has
+                    // to be checked before it leaves
+                    if (!pShared->Valid(slot, seq)) {
+                        torn = true;
+                        break;
+                    }
+                    flush(pDrawList);
+                }
+            }
+        }
+        if (torn || !pShared->Valid(slot, seq)) {
+            pDrawList->Clear();
+            pDrawList->dropped = true;
+            animationFinished = true;
+            return;
+        }
+        if (levelFinished) {
+            stepTotalDist = 0;
+            if (animationLevel == numLevels) {
+                animationFinished = true;
+            } else {
+                animationLevel++;
+            }
+        }
+    }
+};
+
+inline bool SharedTree::Acquire(SharedTreeView& view, std::chrono::milliseconds timeout,
+                                const std::atomic<bool>& running) {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+    while (running && std::chrono::steady_clock::now() < deadline) {
+        if (MapReader() && Header()->magic.load(std::memory_order_acquire) == sharedTreeMagic &&
+            Header()->maxLevels <= maxSharedLevels &&
+            SegmentOffset(Header()->maxLevels, 2) <= mapSize) {
+            layoutLevels = Header()->maxLevels;
+            std::uint64_t generation = Header()->generation.load(std::memory_order_acquire);
+            unsigned int slot = Header()->current.load(std::memory_order_acquire);
+            // Bounds first, the header may be written by any process
+            if (generation != seenGeneration && slot < 2) {
+                std::uint32_t seq = Header()->slots[slot].seq.load(std::memory_order_acquire);
+                if (seq % 2 == 0 && Header()->slots[slot].numLevels <= layoutLevels &&
+                    view.Attach(this, slot, seq)) {
+                    seenGeneration = generation;
+                    return true;
+                }
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef TileExporter_h
+#define TileExporter_h
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "FTree.h"
+
+// 2^27 segments of geometry is already 4 GiB, and bins index segments
+// with 32 bits
+const unsigned int maxExportLevels = 26;
+// The bin index keeps one offset per tile, 128 MiB at this many tiles
+const std::size_t maxExportBins = 1 << 24;
+
+struct ExportSegment {
+    float x1;
+    float y1;
+    float x2;
+    float y2;
+    float halfWidth;
+    unsigned long int color;
+};
+
+/*
+ * Renders an FTree far larger than any pixmap into a binary PPM on disk.
+ * The image is cut into square tiles; a bin index with one bin per tile is
+ * built once so each tile only rasterizes the segments that touch it. Tiles
+ * render in parallel and each one is written straight to its rows in the
+ * file, so peak memory is one tile per thread plus the tree geometry.
+ */
+class TileExporter {
+    /* Variables */
+    private:
+    unsigned int width;
+    unsigned int height;
+    unsigned int tileSize;
+    unsigned int numThreads;
+    double widthScale;
+    unsigned int binsX = 0;
+    unsigned int binsY = 0;
+    std::size_t numBins = 0;
+    std::vector<ExportSegment> segments;
+    std::vector<std::size_t> binOffsets;
+    std::vector<std::uint32_t> binSegments;
+
+    /* Functions */
+    public:
+    TileExporter(unsigned int width, unsigned int height, unsigned int tileSize,
+                 double widthScale, unsigned int numThreads) {
+        this->width = width;
+        this->height = height;
+        // A tile never needs to be larger than the image
+        this->tileSize = std::min(tileSize, std::max(width, height));
+        this->widthScale = widthScale;
+        this->numThreads = numThreads;
+        binsX = (width + this->tileSize - 1) / this->tileSize;
+        binsY = (height + this->tileSize - 1) / this->tileSize;
+        numBins = static_cast<std::size_t>(binsX) * binsY;
+    }
+
+    // Callers reject exports with more than maxExportBins tiles before
+    // indexing them
+    std::size_t NumBins() const {
+        return numBins;
+    }
+
+    // Flattens the tree level by level, so every bin lists its segments in
+    // the same order the screen draws them, then buckets them by tile. False
+    // if the tree is deeper than maxExportLevels.
+    bool Index(FTree& fTree) {
+        const std::vector<Level>& levels = fTree.Levels();
+        if (levels.empty() || levels.size() - 1 > maxExportLevels) {
+            return false;
+        }
+        unsigned int numLevels = levels.size() - 1;
+        std::vector<std::size_t> cursors(numLevels + 1);
+        for (unsigned int depth = 0; depth <= numLevels; depth++) {
+            cursors[depth] = FTree::LevelOffset(depth);
+        }
+        segments.resize(FTree::LevelOffset(numLevels + 1));
+        fTree.Walk(numLevels, [&](unsigned int level, const Point& start, const Point& end) {
+            ExportSegment& segment = segments[cursors[level]++];
+            segment.x1 = start.x;
+            segment.y1 = start.y;
+            segment.x2 = end.x;
+            segment.y2 = end.y;
+            segment.halfWidth = levels[level].width * widthScale * 0.5;
+            segment.color = levels[level].color;
+        });
+
+        // Count, prefix sum, then fill so the index is two flat arrays
+        binOffsets.assign(numBins + 1, 0);
+        for (const ExportSegment& segment : segments) {
+            ForEachBin(segment, [&](std::size_t bin) {
+                binOffsets[bin + 1]++;
+            });
+        }
+        for (std::size_t bin = 0; bin < numBins; bin++) {
+            binOffsets[bin + 1] += binOffsets[bin];
+        }
+        binSegments.resize(binOffsets.back());
+        std::vector<std::size_t> fill(binOffsets.begin(), binOffsets.end() - 1);
+        for (std::size_t i = 0; i < segments.size(); i++) {
+            ForEachBin(segments[i], [&](std::size_t bin) {
+                binSegments[fill[bin]++] = i;
+            });
+        }
+        return true;
+    }
+
+    bool Write(const std::string& path) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        char header[64];
+        int headerSize = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", width, height);
+        off_t fileSize = headerSize + static_cast<off_t>(width) * height * 3;
+        if (ftruncate(fd, fileSize) != 0 || pwrite(fd, header, headerSize, 0) != headerSize) {
+            close(fd);
+            return false;
+        }
+
+        std::atomic<std::size_t> nextTile(0);
+        std::atomic<bool> failed(false);
+        auto worker = [&]() {
+            std::vector<unsigned char> pixels(static_cast<std::size_t>(tileSize) * tileSize * 3);
+            std::size_t tile;
+            while (!failed && (tile = nextTile++) < numBins) {
+                unsigned int tileX = tile % binsX;
+                unsigned int tileY = tile / binsX;
+                unsigned int x0 = tileX * tileSize;
+                unsigned int y0 = tileY * tileSize;
+                unsigned int tileWidth = std::min(tileSize, width - x0);
+                unsigned int tileHeight = std::min(tileSize, height - y0);
+                RenderTile(tile, x0, y0, tileWidth, tileHeight, pixels);
+                for (unsigned int row = 0; row < tileHeight; row++) {
+                    off_t offset = headerSize + (static_cast<off_t>(y0 + row) * width + x0) * 3;
+                    ssize_t rowSize = tileWidth * 3;
+                    if (pwrite(fd, &pixels[static_cast<std::size_t>(row) * tileWidth * 3], rowSize, offset) != rowSize) {
+                        failed = true;
+                        break;
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < numThreads; i++) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        return close(fd) == 0 && !failed;
+    }
+
+    private:
+    template <typename Visit>
+    void ForEachBin(const ExportSegment& segment, Visit visit) {
+        double pad = segment.halfWidth + 1.0;
+        double minX = std::min(segment.x1, segment.x2) - pad;
+        double maxX = std::max(segment.x1, segment.x2) + pad;
+        double minY = std::min(segment.y1, segment.y2) - pad;
+        double maxY = std::max(segment.y1, segment.y2) + pad;
+        // Written so NaN bounds are rejected too
+        if (!(maxX >= 0.0 && maxY >= 0.0 && minX < width && minY < height)) {
+            return;
+        }
+        // Clamp while still a double, converting an out of range double is
+        // undefined
+        unsigned int binX0 = std::max(minX, 0.0) / tileSize;
+        unsigned int binY0 = std::max(minY, 0.0) / tileSize;
+        unsigned int binX1 = std::min(maxX / tileSize, binsX - 1.0);
+        unsigned int binY1 = std::min(maxY / tileSize, binsY - 1.0);
+        for (unsigned int binY = binY0; binY <= binY1; binY++) {
+            for (unsigned int binX = binX0; binX <= binX1; binX++) {
+                visit(static_cast<std::size_t>(binY) * binsX + binX);
+            }
+        }
+    }
+
+    // Round capped lines with one pixel of antialiasing, matching the
+    // CapRound lines drawn on screen
+    void RenderTile(std::size_t tile, unsigned int x0, unsigned int y0,
+                    unsigned int tileWidth, unsigned int tileHeight,
+                    std::vector<unsigned char>& pixels) {
+        std::fill(pixels.begin(), pixels.begin() + static_cast<std::size_t>(tileWidth) * tileHeight * 3, 0);
+        for (std::size_t i = binOffsets[tile]; i < binOffsets[tile + 1]; i++) {
+            const ExportSegment& segment = segments[binSegments[i]];
+            double pad = segment.halfWidth + 1.0;
+            int minX = std::max(static_cast<int>(floor(std::min(segment.x1, segment.x2) - pad)), static_cast<int>(x0));
+            int maxX = std::min(static_cast<int>(ceil(std::max(segment.x1, segment.x2) + pad)), static_cast<int>(x0 + tileWidth) - 1);
+            int minY = std::max(static_cast<int>(floor(std::min(segment.y1, segment.y2) - pad)), static_cast<int>(y0));
+            int maxY = std::min(static_cast<int>(ceil(std::max(segment.y1, segment.y2) + pad)), static_cast<int>(y0 + tileHeight) - 1);
+            double dx = segment.x2 - segment.x1;
+            double dy = segment.y2 - segment.y1;
+            double lengthSq = dx * dx + dy * dy;
+            double red = (segment.color >> 16) & 0xff;
+            double green = (segment.color >> 8) & 0xff;
+            double blue = segment.color & 0xff;
+            for (int y = minY; y <= maxY; y++) {
+                for (int x = minX; x <= maxX; x++) {
+                    double px = x + 0.5 - segment.x1;
+                    double py = y + 0.5 - segment.y1;
+                    double t = 0.0;
+                    if (lengthSq > 0.0) {
+                        t = std::min(std::max((px * dx + py * dy) / lengthSq, 0.0), 1.0);
+                    }
+                    double ex = px - t * dx;
+                    double ey = py - t * dy;
+                    double coverage = segment.halfWidth + 0.5 - sqrt(ex * ex + ey * ey);
+                    if (coverage <= 0.0) {
+                        continue;
+                    }
+                    coverage = std::min(coverage, 1.0);
+                    unsigned char* pPixel = &pixels[(static_cast<std::size_t>(y - y0) * tileWidth + (x - x0)) * 3];
+                    pPixel[0] += static_cast<int>((red - pPixel[0]) * coverage);
+                    pPixel[1] += static_cast<int>((green - pPixel[1]) * coverage);
+                    pPixel[2] += static_cast<int>((blue - pPixel[2]) * coverage);
+                }
+            }
+        }
+    }
+};
+
+#endif
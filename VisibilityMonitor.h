@@ -0,0 +1,120 @@
+#ifndef VisibilityMonitor_h
+#define VisibilityMonitor_h
+
+#include <chrono>
+#include <poll.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/dpms.h>
+
+/*
+ * Tracks whether anything drawn to the window can be seen: it has to be
+ * mapped, not fully obscured, and the monitor has to be powered on. Window
+ * state comes from X events; DPMS has no events so it is polled. Also keeps
+ * the counters for how often and how long drawing was suspended.
+ */
+class VisibilityMonitor {
+    /* Variables */
+    private:
+    Display* pDisplay;
+    Window window;
+    bool mapped = true;
+    bool obscured = false;
+    bool dpmsAvailable = false;
+    bool monitorOn = true;
+    bool suspended = false;
+    std::chrono::steady_clock::time_point lastDpmsPoll;
+    std::chrono::steady_clock::time_point suspendStart;
+    unsigned long int suspensions = 0;
+    double suspendedSeconds = 0.0;
+    const std::chrono::milliseconds dpmsPeriod{1000};
+
+    /* Functions */
+    public:
+    VisibilityMonitor(Display* pDisplay, Window window) {
+        this->pDisplay = pDisplay;
+        this->window = window;
+        XWindowAttributes attributes;
+        if (XGetWindowAttributes(pDisplay, window, &attributes)) {
+            mapped = attributes.map_state != IsUnmapped;
+            XSelectInput(pDisplay, window, attributes.your_event_mask |
+                         VisibilityChangeMask | StructureNotifyMask);
+        }
+        int eventBase;
+        int errorBase;
+        dpmsAvailable = DPMSQueryExtension(pDisplay, &eventBase, &errorBase) &&
+                        DPMSCapable(pDisplay);
+        lastDpmsPoll = std::chrono::steady_clock::now() - dpmsPeriod;
+    }
+
+    // Drains pending events, polls DPMS when due and returns whether drawing
+    // should be suspended
+    bool Update() {
+        while (XPending(pDisplay) > 0) {
+            XEvent event;
+            XNextEvent(pDisplay, &event);
+            if (event.xany.window != window) {
+                continue;
+            }
+            switch (event.type) {
+                case VisibilityNotify:
+                    obscured = event.xvisibility.state == VisibilityFullyObscured;
+                    break;
+                case MapNotify:
+                    mapped = true;
+                    break;
+                case UnmapNotify:
+                    mapped = false;
+                    break;
+            }
+        }
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (dpmsAvailable && now - lastDpmsPoll >= dpmsPeriod) {
+            lastDpmsPoll = now;
+            CARD16 powerLevel;
+            BOOL enabled;
+            if (DPMSInfo(pDisplay, &powerLevel, &enabled)) {
+                monitorOn = !enabled || powerLevel == DPMSModeOn;
+            }
+        }
+
+        bool hidden = !mapped || obscured || !monitorOn;
+        if (hidden && !suspended) {
+            suspensions++;
+            suspendStart = now;
+        } else if (!hidden && suspended) {
+            suspendedSeconds += std::chrono::duration<double>(now - suspendStart).count();
+        }
+        suspended = hidden;
+        return suspended;
+    }
+
+    // Sleeps until an event arrives or timeout passes, without spinning
+    void Wait(std::chrono::milliseconds timeout) {
+        if (XPending(pDisplay) > 0) {
+            return;
+        }
+        pollfd connection;
+        connection.fd = ConnectionNumber(pDisplay);
+        connection.events = POLLIN;
+        poll(&connection, 1, timeout.count());
+    }
+
+    bool Suspended() {
+        return suspended;
+    }
+
+    unsigned long int Suspensions() {
+        return suspensions;
+    }
+
+    double SuspendedSeconds() {
+        double total = suspendedSeconds;
+        if (suspended) {
+            total += std::chrono::duration<double>(std::chrono::steady_clock::now() - suspendStart).count();
+        }
+        return total;
+    }
+};
+
+#endif
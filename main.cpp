@@ -1,14 +1,48 @@
 #include <X11/Xlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <string>
 #include <vector>
 #include <cmath>
 #include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
 
 #include "CLIParser/CLIParser.h"
 
 #include "vroot.h"
 #include "FTree.h"
+#include "Forest.h"
+#include "TileExporter.h"
+#include "SharedTree.h"
+#include "VisibilityMonitor.h"
+#include "DrawList.h"
+#include "SPSCQueue.h"
+
+// Frames in flight between the producer and render threads
+const unsigned int numFrames = 4;
+// Largest export side; the number of tiles is checked separately
+const long int maxExportSize = 1 << 20;
+// Largest export tile side, every render thread holds one tile of pixels
+const unsigned int maxTileSize = 8192;
+// Deeper trees and forests always stream, a stored tree or forest shape is
+// 2^(levels + 1) branches
+const unsigned int maxStoredLevels = 16;
+// How long a reader waits for a new shared tree before trying to publish
+const std::chrono::milliseconds sharedTimeout(1000);
+// How often the render thread wakes up to check visibility while it waits
+const std::chrono::milliseconds suspendPoll(100);
+
+// Set from SIGTERM and SIGINT, which is how xscreensaver stops a saver, so
+// the render loop can end and everything is torn down normally
+std::atomic<bool> stopRequested(false);
+
+void RequestStop(int) {
+    stopRequested = true;
+}
 
 unsigned long int CreateColor(int red, int green, int blue) {
     return (red << 16) + (green << 8) + blue;
@@ -82,6 +116,78 @@ CLIParser::OPTIONS InitOptions() {
         CLIParser::ARG_TYPE::REQUIRED_ARG,
         CLIParser::OPT_TYPE::OPTIONAL_OPT
     };
+    options["levels"] = {
+        "-levels",
+        "-l",
+        CLIParser::ARG_TYPE::REQUIRED_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["stream"] = {
+        "-stream",
+        "-t",
+        CLIParser::ARG_TYPE::OPTIONAL_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["forest"] = {
+        "-forest",
+        "-f",
+        CLIParser::ARG_TYPE::REQUIRED_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["species"] = {
+        "-species",
+        "-k",
+        CLIParser::ARG_TYPE::REQUIRED_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["export"] = {
+        "-export",
+        "-x",
+        CLIParser::ARG_TYPE::REQUIRED_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["exportWidth"] = {
+        "-exportWidth",
+        "-i",
+        CLIParser::ARG_TYPE::REQUIRED_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["exportHeight"] = {
+        "-exportHeight",
+        "-j",
+        CLIParser::ARG_TYPE::REQUIRED_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["tileSize"] = {
+        "-tile",
+        "-n",
+        CLIParser::ARG_TYPE::REQUIRED_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["seed"] = {
+        "-seed",
+        "-g",
+        CLIParser::ARG_TYPE::REQUIRED_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["share"] = {
+        "-share",
+        "-u",
+        CLIParser::ARG_TYPE::OPTIONAL_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["stats"] = {
+        "-stats",
+        "-o",
+        CLIParser::ARG_TYPE::OPTIONAL_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
+    options["batchSize"] = {
+        "-batch",
+        "-c",
+        CLIParser::ARG_TYPE::REQUIRED_ARG,
+        CLIParser::OPT_TYPE::OPTIONAL_OPT
+    };
         
     return options;
 }
@@ -202,6 +308,111 @@ int main(int argc, char* argv[]) {
             std::cerr << "pause time out of range" << std::endl;
         }
     }
+    unsigned int levels = 9;
+    if (options["levels"].flag) {
+        try {
+            levels = std::stoul(options["levels"].result);
+        } catch (std::invalid_argument const& e) {
+            std::cerr << "levels must be an integer" << std::endl;
+        } catch (std::out_of_range const& e) {
+            std::cerr << "levels out of range" << std::endl;
+        }
+    }
+    // Forest mode grows forestSize trees at once from numSpecies shared
+    // shapes and palettes
+    unsigned int forestSize = 0;
+    if (options["forest"].flag) {
+        try {
+            forestSize = std::stoul(options["forest"].result);
+        } catch (std::invalid_argument const& e) {
+            std::cerr << "forest size must be an integer" << std::endl;
+        } catch (std::out_of_range const& e) {
+            std::cerr << "forest size out of range" << std::endl;
+        }
+    }
+    unsigned int numSpecies = 4;
+    if (options["species"].flag) {
+        try {
+            numSpecies = std::stoul(options["species"].result);
+        } catch (std::invalid_argument const& e) {
+            std::cerr << "species must be an integer" << std::endl;
+        } catch (std::out_of_range const& e) {
+            std::cerr << "species out of range" << std::endl;
+        }
+    }
+    if (numSpecies == 0) {
+        numSpecies = 1;
+    }
+    // Export renders one tree to an image file instead of the screen
+    long int exportWidthArg = 16384;
+    if (options["exportWidth"].flag) {
+        try {
+            exportWidthArg = std::stol(options["exportWidth"].result);
+        } catch (std::invalid_argument const& e) {
+            std::cerr << "export width must be an integer" << std::endl;
+        } catch (std::out_of_range const& e) {
+            std::cerr << "export width out of range" << std::endl;
+        }
+    }
+    long int exportHeightArg = 16384;
+    if (options["exportHeight"].flag) {
+        try {
+            exportHeightArg = std::stol(options["exportHeight"].result);
+        } catch (std::invalid_argument const& e) {
+            std::cerr << "export height must be an integer" << std::endl;
+        } catch (std::out_of_range const& e) {
+            std::cerr << "export height out of range" << std::endl;
+        }
+    }
+    unsigned int tileSize = 512;
+    if (options["tileSize"].flag) {
+        try {
+            tileSize = std::stoul(options["tileSize"].result);
+        } catch (std::invalid_argument const& e) {
+            std::cerr << "tile size must be an integer" << std::endl;
+        } catch (std::out_of_range const& e) {
+            std::cerr << "tile size out of range" << std::endl;
+        }
+    }
+    if (tileSize == 0 || tileSize > maxTileSize) {
+        std::cerr << "tile size must be between 1 and " << maxTileSize << std::endl;
+        tileSize = 512;
+    }
+    if (exportWidthArg <= 0 || exportWidthArg > maxExportSize) {
+        std::cerr << "export width must be between 1 and " << maxExportSize << std::endl;
+        exportWidthArg = 16384;
+    }
+    if (exportHeightArg <= 0 || exportHeightArg > maxExportSize) {
+        std::cerr << "export height must be between 1 and " << maxExportSize << std::endl;
+        exportHeightArg = 16384;
+    }
+    unsigned int exportWidth = exportWidthArg;
+    unsigned int exportHeight = exportHeightArg;
+    unsigned int seed = time(0);
+    if (options["seed"].flag) {
+        try {
+            seed = std::stoul(options["seed"].result);
+        } catch (std::invalid_argument const& e) {
+            std::cerr << "seed must be an integer" << std::endl;
+        } catch (std::out_of_range const& e) {
+            std::cerr << "seed out of range" << std::endl;
+        }
+    }
+    bool stream = options["stream"].flag || levels > maxStoredLevels;
+    bool share = options["share"].flag;
+    bool showStats = options["stats"].flag;
+    // Streamed frames are split into chunks of batchSize segments so memory
+    // stays bounded however deep the tree is
+    std::size_t batchSize = stream ? 4096 : 0;
+    if (options["batchSize"].flag) {
+        try {
+            batchSize = std::stoul(options["batchSize"].result);
+        } catch (std::invalid_argument const& e) {
+            std::cerr << "batch size must be an integer" << std::endl;
+        } catch (std::out_of_range const& e) {
+            std::cerr << "batch size out of range" << std::endl;
+        }
+    }
 
 
     if (minAngle > maxAngle) {
@@ -224,7 +435,50 @@ int main(int argc, char* argv[]) {
     double framePeriod = 1.0 / fps;
 
     // Seed random
-    srand(time(0));
+    srand(seed);
+
+    // Grows a tree with random parameters within the configured ranges
+    auto RandomTree = [&](unsigned int width, unsigned int height, bool streaming) {
+        Color start(rand() % 256, rand() % 256, rand() % 256);
+        Color end(rand() % 256, rand() % 256, rand() % 256);
+        double heightVar = static_cast<double>(rand()) / static_cast<double>(RAND_MAX);
+        int startHeight = static_cast<double>(height) * 0.2;
+        startHeight += heightVar * startHeight * 0.2;      
+        double angle = RandDouble() * (maxAngle - minAngle) + minAngle;
+        angle = angle * PI / 180.0;
+        double scale = RandDouble() * (maxScale - minScale) + minScale;
+        double deltaAngle = RandDouble() * (maxDeltaAngle - minDeltaAngle) + minDeltaAngle;
+        deltaAngle = deltaAngle * PI / 180.0;
+        double deltaScale = RandDouble() * (maxDeltaScale - minDeltaScale) + minDeltaScale; 
+        std::unique_ptr<FTree> pTree(new FTree(width, height, deltaAngle, deltaScale, startHeight));
+        pTree->SetStartColor(start);
+        pTree->SetEndColor(end);
+        pTree->SetStreaming(streaming);
+        pTree->Grow(levels, angle, scale);
+        return pTree;
+    };
+
+    if (options["export"].flag) {
+        // Line widths are tuned for a screen around 1080 pixels tall
+        double widthScale = std::max(1.0, exportHeight / 1080.0);
+        unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+        std::unique_ptr<FTree> pTree = RandomTree(exportWidth, exportHeight, true);
+        TileExporter exporter(exportWidth, exportHeight, tileSize, widthScale, numThreads);
+        if (exporter.NumBins() > maxExportBins) {
+            std::cerr << "export needs " << exporter.NumBins() << " tiles, at most "
+                      << maxExportBins << " are supported; use a larger tile size" << std::endl;
+            return 1;
+        }
+        if (!exporter.Index(*pTree)) {
+            std::cerr << "export supports at most " << maxExportLevels << " levels" << std::endl;
+            return 1;
+        }
+        if (!exporter.Write(options["export"].result)) {
+            std::cerr << "failed to write " << options["export"].result << std::endl;
+            return 1;
+        }
+        return 0;
+    }
     
     unsigned int width = 800;
     unsigned int height = 800;
@@ -256,57 +510,269 @@ int main(int argc, char* argv[]) {
     Pixmap blueBuffer = XCreatePixmap(pDisplay, root, width, height, depth); 
     Pixmap* frontBuffer = &redBuffer;
     Pixmap* backBuffer = &blueBuffer; 
-    while (true) {
-        Color start(rand() % 256, rand() % 256, rand() % 256);
-        Color end(rand() % 256, rand() % 256, rand() % 256);
-        double heightVar = static_cast<double>(rand()) / static_cast<double>(RAND_MAX);
-        int startHeight = static_cast<double>(height) * 0.2;
-        startHeight += heightVar * startHeight * 0.2;      
-        double angle = RandDouble() * (maxAngle - minAngle) + minAngle;
-        angle = angle * PI / 180.0;
-        double scale = RandDouble() * (maxScale - minScale) + minScale;
-        double deltaAngle = RandDouble() * (maxDeltaAngle - minDeltaAngle) + minDeltaAngle;
-        deltaAngle = deltaAngle * PI / 180.0;
-        double deltaScale = RandDouble() * (maxDeltaScale - minDeltaScale) + minDeltaScale; 
-        FTree fTree(width, height, deltaAngle, deltaScale, startHeight);
-        fTree.SetStartColor(start);
-        fTree.SetEndColor(end);
-        fTree.Grow(9, angle, scale);
-        fTree.StartAnimation(speed);
-        clock_t prevTime = clock();
-        while (!fTree.AnimationFinished()) {           
-            clock_t currTime = clock(); 
-            double timeElapsed = static_cast<double>(currTime - prevTime) / CLOCKS_PER_SEC; 
-
-            if (timeElapsed > framePeriod) {
-                prevTime = currTime;
-
-
-                // Push front buffer to screen
-                XCopyArea(pDisplay, *frontBuffer, root, gc, 0, 0, width, height, 0, 0);
-
-                // Clear buffer
-                XSetForeground(pDisplay, gc, 0x000000);
-                XFillRectangle(pDisplay, *backBuffer, gc, x, y, width, height);
-
-                // Draw animation
-                fTree.DrawAnimationStep(pDisplay, backBuffer, &gc);   
-                
-                // Present 
-                XSync(pDisplay, False);
-               
-                // Swap buffers 
-                Pixmap* tmpBuffer = frontBuffer;
-                frontBuffer = backBuffer;
-                backBuffer = tmpBuffer;
+
+    // Geometry that has finished growing, drawn once and copied under every
+    // frame
+    Pixmap layerBuffer = XCreatePixmap(pDisplay, root, width, height, depth);
+    XSetForeground(pDisplay, gc, 0x000000);
+    XFillRectangle(pDisplay, layerBuffer, gc, 0, 0, width, height);
+
+    // Frames cycle between the two threads: the producer fills free frames
+    // with draw lists and the render thread hands them back once submitted
+    DrawList frames[numFrames];
+    SPSCQueue<DrawList*, numFrames> freeFrames;
+    SPSCQueue<DrawList*, numFrames> readyFrames;
+    for (unsigned int i = 0; i < numFrames; i++) {
+        freeFrames.Push(&frames[i]);
+    }
+    std::atomic<bool> running(true);
+
+    // Watches the target window and monitor power so drawing can stop while
+    // nothing is visible; only the render thread touches it
+    VisibilityMonitor monitor(pDisplay, root);
+    std::atomic<bool> suspended(false);
+    // The producer parks on freeFrames while suspended, so wake it on resume
+    auto updateVisibility = [&]() {
+        bool hidden = monitor.Update();
+        if (suspended.exchange(hidden) && !hidden) {
+            freeFrames.Notify();
+        }
+        return hidden;
+    };
+
+    // One process per machine generates trees, the others map them
+    SharedTree sharedTree("/ftree-" + std::to_string(getuid()));
+    if (share && forestSize == 0 && levels > maxSharedLevels) {
+        std::cerr << "shared trees are limited to " << maxSharedLevels
+                  << " levels, generating locally" << std::endl;
+        share = false;
+    } else if (share && forestSize == 0 && !sharedTree.Connect(levels)) {
+        std::cerr << "shared tree unavailable, generating locally" << std::endl;
+        share = false;
+    }
+    share = share && forestSize == 0;
+
+    // Stop signals are handled by the render thread; the producer starts
+    // with them blocked so they interrupt the render thread's waits
+    struct sigaction stopAction = {};
+    stopAction.sa_handler = RequestStop;
+    sigemptyset(&stopAction.sa_mask);
+    sigaction(SIGTERM, &stopAction, nullptr);
+    sigaction(SIGINT, &stopAction, nullptr);
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+
+    // Producer thread advances the animation, never touches the display
+    std::thread producer([&]() {
+        // Sleeps until the render thread hands a frame back, and for as long
+        // as it is suspended, so animation stands still while hidden
+        auto acquireFrame = [&](DrawList*& pFrame) {
+            while (running) {
+                if (!suspended && freeFrames.Pop(pFrame)) {
+                    pFrame->Clear();
+                    return true;
+                }
+                freeFrames.Wait([&]() {
+                    return !running || (!suspended && !freeFrames.Empty());
+                });
+            }
+            return false;
+        };
+        // Hand a full chunk to the render thread and continue in a new one
+        auto flushFrame = [&](DrawList*& pFrame) {
+            DrawList* pNext;
+            if (!acquireFrame(pNext)) {
+                pFrame->Clear();
+                return;
+            }
+            readyFrames.Push(pFrame);
+            pFrame = pNext;
+        };
+        // Plays one FTree or Forest animation, false once stopped
+        auto play = [&](auto& scene) {
+            scene.StartAnimation(speed);
+            bool firstStep = true;
+            while (running && !scene.AnimationFinished()) {
+                DrawList* pFrame;
+                if (!acquireFrame(pFrame)) {
+                    return false;
+                }
+                // Each scene starts from an empty layer
+                pFrame->clearLayer = firstStep;
+                firstStep = false;
+                scene.BuildAnimationStep(pFrame, batchSize, flushFrame);
+                pFrame->frameEnd = true;
+                if (scene.AnimationFinished() && !pFrame->dropped) {
+                    pFrame->pauseTime = pauseTime;
+                }
+                readyFrames.Push(pFrame);
+            }
+            return running.load();
+        };
+        while (running) {
+            if (forestSize > 0) {
+                Forest forest(levels, stream);
+                for (unsigned int i = 0; i < numSpecies; i++) {
+                    Color start(rand() % 256, rand() % 256, rand() % 256);
+                    Color end(rand() % 256, rand() % 256, rand() % 256);
+                    forest.AddPalette(start, end);
+                    double heightVar = RandDouble();
+                    int startHeight = static_cast<double>(height) * 0.08;
+                    startHeight += heightVar * startHeight * 0.5;
+                    double angle = RandDouble() * (maxAngle - minAngle) + minAngle;
+                    angle = angle * PI / 180.0;
+                    double scale = RandDouble() * (maxScale - minScale) + minScale;
+                    double deltaAngle = RandDouble() * (maxDeltaAngle - minDeltaAngle) + minDeltaAngle;
+                    deltaAngle = deltaAngle * PI / 180.0;
+                    double deltaScale = RandDouble() * (maxDeltaScale - minDeltaScale) + minDeltaScale; 
+                    forest.AddShape(deltaAngle, deltaScale, startHeight, angle, scale);
+                }
+                for (unsigned int i = 0; i < forestSize; i++) {
+                    Point origin(RandDouble() * width, (0.55 + RandDouble() * 0.45) * height);
+                    // Stagger growth by up to two seconds of frames
+                    unsigned int delay = rand() % static_cast<unsigned int>(fps * 2.0);
+                    forest.AddTree(origin, rand() % numSpecies, rand() % numSpecies, delay);
+                }
+                if (!play(forest)) {
+                    return;
+                }
+                continue;
+            }
+            if (share && !sharedTree.IsPublisher()) {
+                // Show the tree another screen published, or take over
+                // publishing if that process has gone away
+                SharedTreeView view(width, height);
+                if (sharedTree.Acquire(view, sharedTimeout, running)) {
+                    if (!play(view)) {
+                        return;
+                    }
+                    continue;
+                }
+                if (!sharedTree.Connect(levels) || !sharedTree.IsPublisher()) {
+                    continue;
+                }
+            }
+            std::unique_ptr<FTree> pTree = RandomTree(width, height, stream);
+            if (share) {
+                sharedTree.Publish(*pTree, width, height);
+            }
+            if (!play(*pTree)) {
+                return;
+            }
+        }
+    });
+
+    pthread_sigmask(SIG_UNBLOCK, &stopSignals, nullptr);
+
+    // Render thread only submits finished draw lists to the server
+    std::chrono::duration<double> frameDuration(framePeriod);
+    std::chrono::steady_clock::time_point nextFrame = std::chrono::steady_clock::now();
+    bool frameOpen = false;
+    while (!stopRequested) {
+        // Suspend between frames while nothing on screen can be seen
+        if (!frameOpen) {
+            bool wasSuspended = monitor.Suspended();
+            if (updateVisibility()) {
+                monitor.Wait(suspendPoll);
+                continue;
             }
+            if (wasSuspended) {
+                // Carry on from the same frame rather than catching up
+                nextFrame = std::chrono::steady_clock::now();
+                if (showStats) {
+                    std::cerr << "ftree: suspended " << monitor.Suspensions()
+                              << " times for " << monitor.SuspendedSeconds()
+                              << " s" << std::endl;
+                }
+            }
+        }
+
+        DrawList* pFrame;
+        if (!readyFrames.Pop(pFrame)) {
+            // Wake up now and then to keep following visibility
+            readyFrames.WaitFor([&]() {
+                return !readyFrames.Empty();
+            }, suspendPoll);
+            continue;
+        }
+
+        if (pFrame->clearLayer) {
+            XSetForeground(pDisplay, gc, 0x000000);
+            XFillRectangle(pDisplay, layerBuffer, gc, 0, 0, width, height);
         }
-        prevTime = clock();
-        while (static_cast<double>(clock() - prevTime) / CLOCKS_PER_SEC < pauseTime) {
-            (void)0;
+        if (pFrame->layer) {
+            pFrame->Submit(pDisplay, layerBuffer, gc);
+            freeFrames.Push(pFrame);
+            continue;
+        }
+        if (pFrame->dropped) {
+            // Chunks already drawn stay in the back buffer, which the next
+            // frame overwrites; nothing is presented or swapped
+            frameOpen = false;
+            freeFrames.Push(pFrame);
+            continue;
+        }
+
+        if (!frameOpen) {
+            std::this_thread::sleep_until(nextFrame);
+
+            // Push front buffer to screen
+            XCopyArea(pDisplay, *frontBuffer, root, gc, 0, 0, width, height, 0, 0);
+
+            // Start from the finished layer instead of a cleared buffer
+            XCopyArea(pDisplay, layerBuffer, *backBuffer, gc, 0, 0, width, height, 0, 0);
+            frameOpen = true;
+        }
+
+        // Draw animation
+        pFrame->Submit(pDisplay, *backBuffer, gc);
+        bool frameEnd = pFrame->frameEnd;
+        double framePause = pFrame->pauseTime;
+        freeFrames.Push(pFrame);
+        if (!frameEnd) {
+            continue;
+        }
+        frameOpen = false;
+
+        // Present 
+        XSync(pDisplay, False);
+       
+        // Swap buffers 
+        Pixmap* tmpBuffer = frontBuffer;
+        frontBuffer = backBuffer;
+        backBuffer = tmpBuffer;
+
+        nextFrame += std::chrono::duration_cast<std::chrono::steady_clock::duration>(frameDuration);
+        if (nextFrame < std::chrono::steady_clock::now()) {
+            nextFrame = std::chrono::steady_clock::now();
+        }
+        if (framePause > 0.0) {
+            // Show the finished tree for the whole pause, still following
+            // visibility so suspension is counted while paused
+            XCopyArea(pDisplay, *frontBuffer, root, gc, 0, 0, width, height, 0, 0);
+            XSync(pDisplay, False);
+            std::chrono::steady_clock::time_point pauseEnd = std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(framePause));
+            while (!stopRequested && std::chrono::steady_clock::now() < pauseEnd) {
+                updateVisibility();
+                std::chrono::milliseconds remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    pauseEnd - std::chrono::steady_clock::now());
+                if (remaining.count() > 0) {
+                    monitor.Wait(std::min(remaining, suspendPoll));
+                }
+            }
+            nextFrame = std::chrono::steady_clock::now();
         }
     }
 
+    running = false;
+    freeFrames.Notify();
+    producer.join();
+
     XCloseDisplay(pDisplay);
  
     return 0;